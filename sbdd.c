@@ -9,6 +9,16 @@
 #include <linux/stat.h>
 #include <linux/slab.h>
 #include <linux/numa.h>
+#include <linux/nodemask.h>
+#include <linux/log2.h>
+#include <linux/uio.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/xarray.h>
+#include <linux/parser.h>
+#include <linux/t10-pi.h>
+#include <linux/highmem.h>
+#include <linux/crc-t10dif.h>
 #include <linux/errno.h>
 #include <linux/types.h>
 #include <linux/genhd.h>
@@ -16,10 +26,11 @@
 #include <linux/string.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
-#include <linux/vmalloc.h>
 #include <linux/jiffies.h>
+#include <linux/workqueue.h>
 #include <linux/moduleparam.h>
 #include <linux/spinlock_types.h>
+#include <net/checksum.h>
 #ifdef BLK_MQ_MODE
 #include <linux/blk-mq.h>
 #endif
@@ -167,9 +178,56 @@ void unregister_sbd_driver(struct sbd_driver *driver)
 #define SBDD_SECTOR_SHIFT      9
 #define SBDD_SECTOR_SIZE       (1 << SBDD_SECTOR_SHIFT)
 #define SBDD_MIB_SECTORS       (1 << (20 - SBDD_SECTOR_SHIFT))
+#define SBDD_PAGE_SECTORS_SHIFT (PAGE_SHIFT - SBDD_SECTOR_SHIFT)
+#define SBDD_MIB_PAGES         (1 << (20 - PAGE_SHIFT))
 #define SBDD_NAME              "sbdd"
 #define SBDEV_NAME             "sbd"
 #define MAX_DEVICES            16
+/* Pages moved to or from the backing file by a single I/O */
+#define SBDD_WB_BATCH          64
+/* Default age after which a page is written back */
+#define SBDD_COLD_INTERVAL_MS  30000
+/* Page table entries looked at by the cold page scan per lock hold */
+#define SBDD_SCAN_BUDGET       1024
+/* Page table entry of a page whose data lives in the backing file */
+#define SBDD_PAGE_ON_BACKING   xa_mk_value(0)
+/* Protection information tuples stored in a page */
+#define SBDD_PI_PAGE_SHIFT     (PAGE_SHIFT - ilog2(sizeof(struct t10_pi_tuple)))
+
+/* Computes the guard tag of one logical block */
+typedef __be16 (sbdd_csum_fn)(void *, unsigned int);
+
+/*
+ * Scratch space for batched backing file I/O. Every worker owns
+ * its own batch, so no locking is needed.
+ */
+struct sbdd_batch {
+    struct page             *pages[SBDD_WB_BATCH];
+    unsigned long           stamps[SBDD_WB_BATCH];
+    struct bio_vec          vecs[SBDD_WB_BATCH];
+};
+
+/*
+ * Zone of an emulated zoned device. Writes to a sequential zone hold
+ * its lock from the write pointer check until the pointer is advanced.
+ */
+struct sbdd_zone {
+    spinlock_t              lock;
+    sector_t                wp;
+    u8                      type;
+    u8                      cond;
+    /* Entry of sbdd::open_zones while implicitly open */
+    struct list_head        open_link;
+};
+
+#ifdef BLK_MQ_MODE
+struct sbdd_cmd {
+    struct list_head        list;
+};
+#endif
+
+/* How a composite device spreads its data over the member devices */
+enum sbdd_layout {SBDD_PLAIN = 0, SBDD_STRIPED, SBDD_MIRRORED};
 
 struct sbdd {
     char                    *name;
@@ -179,7 +237,55 @@ struct sbdd {
 	atomic_t                deleting;
 	atomic_t                refs_cnt;
 	sector_t                capacity;
-	u8                      *data;
+    /*
+     * Device pages indexed by page offset. An entry is either a resident
+     * page (page->private holds the jiffies of the last access),
+     * SBDD_PAGE_ON_BACKING or nothing for a never written page.
+     */
+    struct xarray           pages;
+    /* Taken for write only to evict pages, I/O holds it for read */
+    struct rw_semaphore     evict_sem;
+    struct file             *backing;
+    unsigned long           mem_limit_pages;
+    unsigned int            cold_interval_ms;
+    atomic_long_t           resident_pages;
+    atomic_long_t           writeback_pages;
+    atomic_long_t           faultin_pages;
+    /*
+     * Protection information tuples of every sector, allocated along with
+     * the data pages and never written back
+     */
+    struct xarray           pi;
+    sbdd_csum_fn            *pi_csum;
+    struct delayed_work     wb_work;
+    struct sbdd_batch       *wb_batch;
+    struct work_struct      fault_work;
+    struct sbdd_batch       *fault_batch;
+    spinlock_t              fault_lock;
+    struct sbdd_zone        *zones;
+    unsigned int            nr_zones;
+    unsigned int            zone_shift;
+    unsigned int            max_open;
+    /* Implicitly open zones, oldest first, protected by open_lock */
+    spinlock_t              open_lock;
+    struct list_head        open_zones;
+    unsigned int            nr_open;
+    int                     numa_node;
+    /* Devices the data of a composite device lives on */
+    struct sbdd             **members;
+    unsigned int            nr_members;
+    enum sbdd_layout        layout;
+    unsigned int            chunk_shift;
+    atomic_t                next_mirror;
+    /* Composite device this device is a member of */
+    struct sbdd             *holder;
+    /* Read-only flag of the disk before it became a member */
+    int                     was_ro;
+#ifdef BLK_MQ_MODE
+    struct list_head        fault_rqs;
+#else
+    struct bio_list         fault_bios;
+#endif
 	struct gendisk          *gd;
 	struct request_queue    *q;
     struct device           *dev;
@@ -188,21 +294,61 @@ struct sbdd {
 #endif
 };
 
+/* Per-device options which can be passed to create command */
+struct sbdd_opts {
+    char                    *backing_path;
+    unsigned int            mem_limit_mib;
+    unsigned int            cold_interval_ms;
+    sbdd_csum_fn            *pi_csum;
+    bool                    zoned;
+    unsigned int            zone_size_mib;
+    unsigned int            conv_zones;
+    unsigned int            max_open;
+    int                     numa_node;
+    enum sbdd_layout        layout;
+    unsigned int            chunk_shift;
+    struct sbdd             **members;
+    unsigned int            nr_members;
+};
+
 static struct sbdd      *__devices;
 static struct sbdd      __zero_sbdd = {0};
 static int              __sbdd_major = 0;
 static unsigned long    __sbdd_capacity_mib = 100;
+static unsigned int     __sbdd_cold_interval_ms = SBDD_COLD_INTERVAL_MS;
 static spinlock_t       __creating_new_disk;
+/* Serializes commands, resize and compose look at other devices' state */
+static DEFINE_MUTEX(__sbdd_cmd_mutex);
+static struct workqueue_struct *__sbdd_wq;
+
+/* A zero interval would requeue the writeback work without a delay */
+static void check_cold_interval(void)
+{
+    if(__sbdd_cold_interval_ms)
+        return;
+    pr_warn("cold_interval_ms must be positive. %u will be used instead\n",
+            SBDD_COLD_INTERVAL_MS);
+    __sbdd_cold_interval_ms = SBDD_COLD_INTERVAL_MS;
+}
+
+static void sbdd_opts_init(struct sbdd_opts *opts)
+{
+    memset(opts, 0, sizeof(struct sbdd_opts));
+    opts->cold_interval_ms = __sbdd_cold_interval_ms;
+    opts->zone_size_mib = 256;
+    opts->numa_node = NUMA_NO_NODE;
+}
 
 /*
  * Making a unified interface for user command execution
  */
 
-#define COMMAND_NUMBER 2
+#define COMMAND_NUMBER 4
 
-enum commands {CREATE_COMMAND = 0, CHANGE_MODE_COMMAND};
+enum commands {CREATE_COMMAND = 0, CHANGE_MODE_COMMAND, RESIZE_COMMAND, COMPOSE_COMMAND};
 
-static const char *command_names[] = {[CREATE_COMMAND] = "create", [CHANGE_MODE_COMMAND] = "change_mode"};
+static const char *command_names[] = {[CREATE_COMMAND] = "create", [CHANGE_MODE_COMMAND] = "change_mode",
+                                      [RESIZE_COMMAND] = "resize", [COMPOSE_COMMAND] = "compose"};
 
 typedef int (*executor)(const char*, size_t);
 
@@ -210,14 +356,20 @@ static int create_com(const char* buf, size_t count);
 
 static int change_mode_com(const char* buf, size_t count);
 
-static int add_new_sbdd(unsigned long capacity_mib, char* name, size_t name_len);
+static int resize_com(const char* buf, size_t count);
+
+static int compose_com(const char* buf, size_t count);
+
+static int add_new_sbdd(unsigned long capacity_mib, char* name, size_t name_len,
+                        const struct sbdd_opts *opts);
 
 /*
  * executors should parse the command's args, check them
  * and then execute the command itself
  */
 
-static const executor command_execs[] = {[CREATE_COMMAND] = create_com, [CHANGE_MODE_COMMAND] = change_mode_com};
+static const executor command_execs[] = {[CREATE_COMMAND] = create_com, [CHANGE_MODE_COMMAND] = change_mode_com,
+                                         [RESIZE_COMMAND] = resize_com, [COMPOSE_COMMAND] = compose_com};
 
 static ssize_t execute_command(struct device_driver *driver, const char *buf,
                                size_t count)
@@ -234,7 +386,9 @@ static ssize_t execute_command(struct device_driver *driver, const char *buf,
                  *(begin + name_len) == '\n' ||
                  *(begin + name_len) == '\0')){
             pr_info("command %s parsed\n", name);
+            mutex_lock(&__sbdd_cmd_mutex);
             ret = command_execs[i](buf, count);
+            mutex_unlock(&__sbdd_cmd_mutex);
             if(ret)
                 return ret;
             else
@@ -245,6 +399,121 @@ static ssize_t execute_command(struct device_driver *driver, const char *buf,
     return count;
 }
 
+enum {OPT_BACKING, OPT_MEM_LIMIT, OPT_COLD_INTERVAL, OPT_INTEGRITY, OPT_ZONED,
+      OPT_ZONE_SIZE, OPT_CONV_ZONES, OPT_MAX_OPEN, OPT_NUMA_NODE, OPT_ERR};
+
+static const match_table_t create_opt_tokens = {
+    {OPT_BACKING, "backing=%s"},
+    {OPT_MEM_LIMIT, "mem_limit=%u"},
+    {OPT_COLD_INTERVAL, "cold_interval=%u"},
+    {OPT_INTEGRITY, "integrity=%s"},
+    {OPT_ZONED, "zoned"},
+    {OPT_ZONE_SIZE, "zone_size=%u"},
+    {OPT_CONV_ZONES, "conv_zones=%u"},
+    {OPT_MAX_OPEN, "max_open=%u"},
+    {OPT_NUMA_NODE, "numa_node=%u"},
+    {OPT_ERR, NULL}
+};
+
+static __be16 sbdd_crc_fn(void *data, unsigned int len)
+{
+    return cpu_to_be16(crc_t10dif(data, len));
+}
+
+static __be16 sbdd_ip_fn(void *data, unsigned int len)
+{
+    return (__force __be16)ip_compute_csum(data, len);
+}
+
+/*
+ * Optional create arguments have the form key=value and follow
+ * the name and the capacity in any order
+ */
+static int parse_create_opts(char *options, struct sbdd_opts *opts)
+{
+    char *p;
+    substring_t args[MAX_OPT_ARGS];
+    bool writeback_opts = false;
+    int value;
+    while((p = strsep(&options, " \n")) != NULL){
+        if(!*p)
+            continue;
+        switch(match_token(p, create_opt_tokens, args)){
+        case OPT_BACKING:
+            kfree(opts->backing_path);
+            opts->backing_path = match_strdup(&args[0]);
+            if(!opts->backing_path)
+                return -ENOMEM;
+            break;
+        case OPT_MEM_LIMIT:
+            if(match_int(&args[0], &value) || value < 0)
+                goto bad_opt;
+            opts->mem_limit_mib = value;
+            writeback_opts = true;
+            break;
+        case OPT_COLD_INTERVAL:
+            if(match_int(&args[0], &value) || value <= 0)
+                goto bad_opt;
+            opts->cold_interval_ms = value;
+            writeback_opts = true;
+            break;
+        case OPT_INTEGRITY:
+#ifndef CONFIG_BLK_DEV_INTEGRITY
+            pr_err("kernel is built without block integrity support\n");
+            return -EOPNOTSUPP;
+#endif
+            /* The value runs up to the end of the option */
+            if(!strcmp(args[0].from, "crc"))
+                opts->pi_csum = sbdd_crc_fn;
+            else if(!strcmp(args[0].from, "ip"))
+                opts->pi_csum = sbdd_ip_fn;
+            else
+                goto bad_opt;
+            break;
+        case OPT_ZONED:
+#ifndef CONFIG_BLK_DEV_ZONED
+            pr_err("kernel is built without zoned block device support\n");
+            return -EOPNOTSUPP;
+#endif
+            opts->zoned = true;
+            break;
+        case OPT_ZONE_SIZE:
+            /* The block layer needs zones of a power of two size */
+            if(match_int(&args[0], &value) || value <= 0 || !is_power_of_2(value))
+                goto bad_opt;
+            opts->zone_size_mib = value;
+            break;
+        case OPT_CONV_ZONES:
+            if(match_int(&args[0], &value) || value < 0)
+                goto bad_opt;
+            opts->conv_zones = value;
+            break;
+        case OPT_MAX_OPEN:
+            if(match_int(&args[0], &value) || value < 0)
+                goto bad_opt;
+            opts->max_open = value;
+            break;
+        case OPT_NUMA_NODE:
+            if(match_int(&args[0], &value) || value < 0 ||
+               value >= MAX_NUMNODES || !node_online(value))
+                goto bad_opt;
+            opts->numa_node = value;
+            break;
+        default:
+            goto bad_opt;
+        }
+    }
+    /* Without a backing file nothing is ever written back */
+    if(writeback_opts && !opts->backing_path){
+        pr_err("mem_limit and cold_interval require a backing file\n");
+        return -EINVAL;
+    }
+    return 0;
+    bad_opt:
+    pr_err("unknown or malformed option %s\n", p);
+    return -EINVAL;
+}
+
 static int create_com(const char* buf, size_t count)
 {
     const char *comm = command_names[CREATE_COMMAND];
@@ -253,7 +522,10 @@ static int create_com(const char* buf, size_t count)
     const char *space = strstr(args, " ");
     size_t name_len = 0;
     char* name;
+    char* options;
     unsigned long capacity_mib = 0;
+    struct sbdd_opts opts;
+    int consumed = 0;
     int ret = 0;
     if(__mode == AUTO){
         pr_warn("create command is unavailable in auto mode\n");
@@ -273,16 +545,30 @@ static int create_com(const char* buf, size_t count)
         return -EINVAL;
     }
     name = kzalloc(name_len, GFP_KERNEL);
-    ret = sscanf(args, "%s %lu", name, &capacity_mib);
+    ret = sscanf(args, "%s %lu%n", name, &capacity_mib, &consumed);
     if(ret < args_num){
         kvfree(name);
         pr_err("wrong command format\n");
         return -EINVAL;
     }
+    sbdd_opts_init(&opts);
+    options = kstrndup(args + consumed, buf + count - args - consumed, GFP_KERNEL);
+    if(!options){
+        kvfree(name);
+        return -ENOMEM;
+    }
+    ret = parse_create_opts(options, &opts);
+    kfree(options);
+    if(ret){
+        kfree(opts.backing_path);
+        kvfree(name);
+        return ret;
+    }
     pr_debug("create command args: %s %lu\n", name, capacity_mib);
-    ret = add_new_sbdd(capacity_mib, name, name_len);
+    ret = add_new_sbdd(capacity_mib, name, name_len, &opts);
     if(!ret)
         pr_info("device %s created\n", name);
+    kfree(opts.backing_path);
     kvfree(name);
     return ret;
 }
@@ -332,6 +618,11 @@ static int change_mode_com(const char* buf, size_t count)
         kvfree(name);
         return 1;
     }
+    if(dev->holder){
+        pr_warn("device %s is a member of %s\n", name, dev->holder->name);
+        kvfree(name);
+        return -EBUSY;
+    }
     spin_lock(&dev->transferring);
     set_disk_ro(dev->gd, mode);
     spin_unlock(&dev->transferring);
@@ -340,65 +631,1056 @@ static int change_mode_com(const char* buf, size_t count)
     return 0;
 }
 
-static sector_t sbdd_xfer(struct bio_vec* bvec, sector_t pos, int dir, struct sbdd *dev)
+static int sbdd_resize(struct sbdd *dev, unsigned long capacity_mib);
+
+static int resize_com(const char* buf, size_t count)
 {
-	void *buff = page_address(bvec->bv_page) + bvec->bv_offset;
+    const char *comm = command_names[RESIZE_COMMAND];
+    const int args_num = 2;
+    const char *args = strstr(buf, comm) + strlen(comm) + 1;
+    const char *space = strstr(args, " ");
+    size_t name_len = 0;
+    char* name;
+    unsigned long capacity_mib = 0;
+    int ret = 0;
+    struct sbdd *dev;
+    if(!space){
+        pr_err("wrong command format\n");
+        return -EINVAL;
+    }
+    name_len = space - args + 1;
+    if(name_len == 0){
+        pr_err("wrong command format\n");
+        return -EINVAL;
+    }
+    name = kzalloc(name_len, GFP_KERNEL);
+    ret = sscanf(args, "%s %lu", name, &capacity_mib);
+    if(ret < args_num){
+        kvfree(name);
+        pr_err("wrong command format\n");
+        return -EINVAL;
+    }
+    pr_debug("resize command args: %s, %lu\n", name, capacity_mib);
+    dev = find_device_by_name(name);
+    if(!dev){
+        pr_warn("device with name %s not found\n", name);
+        kvfree(name);
+        return 0;
+    }
+    if(atomic_read(&dev->deleting)){
+        pr_warn("device %s is being deleted\n", name);
+        kvfree(name);
+        return 1;
+    }
+    ret = sbdd_resize(dev, capacity_mib);
+    if(!ret)
+        pr_info("device %s is now %lu MiB\n", name, capacity_mib);
+    kvfree(name);
+    return ret;
+}
+
+static sector_t sbdd_compose_capacity(const struct sbdd_opts *opts);
+
+/*
+ * compose <name> raid0 <chunk_kib> <member> <member> ...
+ * compose <name> raid1 <member> <member> ...
+ */
+static int compose_com(const char* buf, size_t count)
+{
+    const char *comm = command_names[COMPOSE_COMMAND];
+    const char *args = strstr(buf, comm) + strlen(comm) + 1;
+    char *line, *cur, *tok;
+    char *name = NULL;
+    unsigned int chunk_kib = 0;
+    struct sbdd_opts opts;
+    struct sbdd *member;
+    int ret = -EINVAL;
+    if(__mode == AUTO){
+        pr_warn("compose command is unavailable in auto mode\n");
+        return 0;
+    }
+    if(args >= buf + count){
+        pr_err("wrong command format\n");
+        return -EINVAL;
+    }
+    line = kstrndup(args, buf + count - args, GFP_KERNEL);
+    sbdd_opts_init(&opts);
+    opts.members = kcalloc(MAX_DEVICES, sizeof(struct sbdd *), GFP_KERNEL);
+    if(!line || !opts.members){
+        ret = -ENOMEM;
+        goto out;
+    }
+    cur = line;
+    while((tok = strsep(&cur, " \n")) != NULL){
+        if(!*tok)
+            continue;
+        if(!name){
+            name = tok;
+        } else if(opts.layout == SBDD_PLAIN){
+            if(!strcmp(tok, "raid0"))
+                opts.layout = SBDD_STRIPED;
+            else if(!strcmp(tok, "raid1"))
+                opts.layout = SBDD_MIRRORED;
+            else
+                goto bad_format;
+        } else if(opts.layout == SBDD_STRIPED && !chunk_kib){
+            if(kstrtouint(tok, 10, &chunk_kib) || !is_power_of_2(chunk_kib))
+                goto bad_format;
+        } else {
+            member = find_device_by_name(tok);
+            if(!member){
+                pr_warn("device with name %s not found\n", tok);
+                goto out;
+            }
+            if(opts.nr_members == MAX_DEVICES)
+                goto bad_format;
+            opts.members[opts.nr_members++] = member;
+        }
+    }
+    if(!name || opts.nr_members < 2)
+        goto bad_format;
+    if(strlen(name) > MAX_DEV_NAME_SIZE){
+        pr_err("maximal device name length is %d\n", MAX_DEV_NAME_SIZE);
+        goto out;
+    }
+    if(opts.layout == SBDD_STRIPED)
+        opts.chunk_shift = ilog2(chunk_kib) + 10 - SBDD_SECTOR_SHIFT;
+    pr_debug("compose command args: %s, %u members\n", name, opts.nr_members);
+    if(!sbdd_compose_capacity(&opts))
+        goto out;
+    ret = add_new_sbdd(0, name, strlen(name) + 1, &opts);
+    if(!ret)
+        pr_info("device %s composed\n", name);
+    goto out;
+
+    bad_format:
+    pr_err("wrong command format\n");
+    out:
+    kfree(opts.members);
+    kfree(line);
+    return ret;
+}
+
+/*
+ * The device is stored page by page, so the cold ones can be written back
+ * to the backing file and freed, and then faulted in again on access.
+ */
+
+static bool sbdd_page_range(struct sbdd *dev, sector_t pos, unsigned int nr_sects,
+                            pgoff_t *first, pgoff_t *last)
+{
+    if(!nr_sects || pos >= dev->capacity)
+        return false;
+    if(pos + nr_sects > dev->capacity)
+        nr_sects = dev->capacity - pos;
+    *first = pos >> SBDD_PAGE_SECTORS_SHIFT;
+    *last = (pos + nr_sects - 1) >> SBDD_PAGE_SECTORS_SHIFT;
+    return true;
+}
+
+static bool sbdd_over_limit(struct sbdd *dev)
+{
+    return dev->backing && dev->mem_limit_pages &&
+           atomic_long_read(&dev->resident_pages) > dev->mem_limit_pages;
+}
+
+static void sbdd_put_ref(struct sbdd *dev)
+{
+    if (atomic_dec_and_test(&dev->refs_cnt))
+        wake_up(&dev->exitwait);
+}
+
+/* Reads or writes nr pages of the batch starting at page first with one I/O */
+static int sbdd_backing_rw(struct sbdd *dev, struct sbdd_batch *batch, int nr,
+                           pgoff_t first, int dir)
+{
+    struct iov_iter iter;
+    loff_t pos = (loff_t)first << PAGE_SHIFT;
+    size_t len = (size_t)nr << PAGE_SHIFT;
+    ssize_t done;
+    int i;
+
+    for(i = 0; i < nr; i++){
+        batch->vecs[i].bv_page = batch->pages[i];
+        batch->vecs[i].bv_offset = 0;
+        batch->vecs[i].bv_len = PAGE_SIZE;
+    }
+    iov_iter_bvec(&iter, dir, batch->vecs, nr, len);
+
+    if(dir){
+        file_start_write(dev->backing);
+        done = vfs_iter_write(dev->backing, &iter, &pos, 0);
+        file_end_write(dev->backing);
+    } else {
+        done = vfs_iter_read(dev->backing, &iter, &pos, 0);
+        /* A truncated backing file reads as zeroes */
+        if(done >= 0 && done < len)
+            done += iov_iter_zero(len - done, &iter);
+    }
+
+    if(done != len){
+        pr_err("%s: backing file %s failed at page %lu with %zd\n", dev->name,
+               dir ? "write" : "read", first, done);
+        return done < 0 ? done : -EIO;
+    }
+    return 0;
+}
+
+static bool sbdd_range_resident(struct sbdd *dev, sector_t pos, unsigned int nr_sects)
+{
+    pgoff_t idx, last;
+
+    if(!dev->backing || !sbdd_page_range(dev, pos, nr_sects, &idx, &last))
+        return true;
+    for(; idx <= last; idx++)
+        if(xa_load(&dev->pages, idx) == SBDD_PAGE_ON_BACKING)
+            return false;
+    return true;
+}
+
+/* Must be called with evict_sem held for read */
+static int sbdd_fault_in(struct sbdd *dev, sector_t pos, unsigned int nr_sects,
+                         struct sbdd_batch *batch)
+{
+    pgoff_t idx, last;
+    int ret = 0;
+    int nr, i;
+
+    if(!sbdd_page_range(dev, pos, nr_sects, &idx, &last))
+        return 0;
+
+    while(idx <= last && !ret){
+        nr = 0;
+        while(idx + nr <= last && nr < SBDD_WB_BATCH &&
+              xa_load(&dev->pages, idx + nr) == SBDD_PAGE_ON_BACKING){
+            batch->pages[nr] = alloc_pages_node(dev->numa_node, GFP_NOIO, 0);
+            if(!batch->pages[nr]){
+                ret = -ENOMEM;
+                break;
+            }
+            nr++;
+        }
+        if(!nr){
+            idx++;
+            continue;
+        }
+        if(!ret)
+            ret = sbdd_backing_rw(dev, batch, nr, idx, READ);
+        for(i = 0; i < nr; i++){
+            struct page *page = batch->pages[i];
+            page->private = jiffies;
+            /* Somebody else could have faulted the page in meanwhile */
+            if(!ret && xa_cmpxchg(&dev->pages, idx + i, SBDD_PAGE_ON_BACKING,
+                                  page, GFP_NOIO) == SBDD_PAGE_ON_BACKING){
+                atomic_long_inc(&dev->resident_pages);
+                atomic_long_inc(&dev->faultin_pages);
+            } else
+                __free_page(page);
+        }
+        idx += nr;
+    }
+    return ret;
+}
+
+/*
+ * Pages are allocated on the first write. Must be called with evict_sem
+ * held for read and before taking the spinlocks as allocation may sleep.
+ */
+static int sbdd_alloc_range(struct sbdd *dev, sector_t pos, unsigned int nr_sects)
+{
+    pgoff_t idx, last;
+    struct page *page, *old;
+
+    if(!sbdd_page_range(dev, pos, nr_sects, &idx, &last))
+        return 0;
+
+    for(; idx <= last; idx++){
+        if(xa_load(&dev->pages, idx))
+            continue;
+        page = alloc_pages_node(dev->numa_node, GFP_NOIO | __GFP_ZERO, 0);
+        if(!page)
+            return -ENOMEM;
+        page->private = jiffies;
+        old = xa_cmpxchg(&dev->pages, idx, NULL, page, GFP_NOIO);
+        if(old){
+            __free_page(page);
+            if(xa_is_err(old))
+                return xa_err(old);
+            continue;
+        }
+        atomic_long_inc(&dev->resident_pages);
+    }
+
+    if(dev->pi_csum){
+        idx = pos >> SBDD_PI_PAGE_SHIFT;
+        last = (pos + nr_sects - 1) >> SBDD_PI_PAGE_SHIFT;
+        for(; idx <= last; idx++){
+            if(xa_load(&dev->pi, idx))
+                continue;
+            page = alloc_pages_node(dev->numa_node, GFP_NOIO, 0);
+            if(!page)
+                return -ENOMEM;
+            /* Escape tuples are not checked until the sector is written */
+            memset(page_address(page), 0xff, PAGE_SIZE);
+            old = xa_cmpxchg(&dev->pi, idx, NULL, page, GFP_NOIO);
+            if(old){
+                __free_page(page);
+                if(xa_is_err(old))
+                    return xa_err(old);
+            }
+        }
+    }
+
+    if(sbdd_over_limit(dev))
+        mod_delayed_work(__sbdd_wq, &dev->wb_work, 0);
+    return 0;
+}
+
+/*
+ * Pages at and past the write pointer of a sequential zone are kept
+ * resident, so zone writes never wait for a fault-in and keep their order.
+ */
+static bool sbdd_page_at_wp(struct sbdd *dev, pgoff_t index)
+{
+    struct sbdd_zone *zone;
+
+    if(!dev->zones)
+        return false;
+    zone = &dev->zones[index >> (dev->zone_shift - SBDD_PAGE_SECTORS_SHIFT)];
+    return zone->type == BLK_ZONE_TYPE_SEQWRITE_REQ &&
+           index >= (READ_ONCE(zone->wp) >> SBDD_PAGE_SECTORS_SHIFT);
+}
+
+/*
+ * Collects up to SBDD_WB_BATCH contiguous cold pages starting the search
+ * at *start. Pages that were not touched for the cold interval are cold,
+ * while the device is over its memory limit every page not touched
+ * during the current jiffy is.
+ *
+ * Only the xarray lock is held and at most SBDD_SCAN_BUDGET entries are
+ * looked at per call, so I/O is not stalled behind a scan of a large
+ * device. Page table references are dropped only after the entry is
+ * erased or replaced under the same lock, which makes get_page() safe.
+ * *more is cleared once the end of the page table is reached.
+ */
+static int sbdd_collect_cold(struct sbdd *dev, unsigned long *start, pgoff_t *first,
+                             struct sbdd_batch *batch, bool *more)
+{
+    unsigned long age = sbdd_over_limit(dev) ? 1 :
+                        msecs_to_jiffies(dev->cold_interval_ms);
+    unsigned long now = jiffies;
+    unsigned long index = *start;
+    unsigned int scanned = 0;
+    struct page *page;
+    void *entry;
+    int nr = 0;
+
+    *more = false;
+    xa_lock(&dev->pages);
+    for(entry = xa_find(&dev->pages, &index, ULONG_MAX, XA_PRESENT); entry;
+        entry = xa_find_after(&dev->pages, &index, ULONG_MAX, XA_PRESENT)){
+        if(++scanned > SBDD_SCAN_BUDGET){
+            *more = true;
+            break;
+        }
+        page = entry;
+        if(xa_is_value(entry) || time_after(page->private + age, now) ||
+           sbdd_page_at_wp(dev, index) || (nr && index != *first + nr)){
+            if(nr){
+                *more = true;
+                break;
+            }
+            continue;
+        }
+        if(!nr)
+            *first = index;
+        get_page(page);
+        batch->pages[nr] = page;
+        batch->stamps[nr] = page->private;
+        if(++nr == SBDD_WB_BATCH){
+            *more = true;
+            break;
+        }
+    }
+    xa_unlock(&dev->pages);
+
+    /* Resume right after the batch or at the entry the budget ran out on */
+    *start = nr ? *first + nr : index;
+    return nr;
+}
+
+/*
+ * Frees the written back pages unless they were accessed during the
+ * write. Stamps of cold pages are older than the current jiffy, so any
+ * access after collecting them changes the stamp.
+ */
+static void sbdd_evict(struct sbdd *dev, struct sbdd_batch *batch, int nr, pgoff_t first)
+{
+    struct page *page;
+    int i;
+
+    down_write(&dev->evict_sem);
+    spin_lock(&dev->datalock);
+    for(i = 0; i < nr; i++){
+        page = batch->pages[i];
+        /* A shrink may erase the page without taking evict_sem */
+        if(page->private != batch->stamps[i] ||
+           xa_cmpxchg(&dev->pages, first + i, page, SBDD_PAGE_ON_BACKING,
+                      GFP_ATOMIC) != page)
+            continue;
+        /* Drop the page table reference, the batch one is dropped by the caller */
+        put_page(page);
+        atomic_long_dec(&dev->resident_pages);
+        atomic_long_inc(&dev->writeback_pages);
+    }
+    spin_unlock(&dev->datalock);
+    up_write(&dev->evict_sem);
+}
+
+static void sbdd_writeback_work(struct work_struct *work)
+{
+    struct sbdd *dev = container_of(to_delayed_work(work), struct sbdd, wb_work);
+    struct sbdd_batch *batch = dev->wb_batch;
+    unsigned long start = 0;
+    pgoff_t first = 0;
+    bool more = true;
+    int nr, i;
+
+    while(more && !atomic_read(&dev->deleting)){
+        nr = sbdd_collect_cold(dev, &start, &first, batch, &more);
+        if(nr){
+            if(!sbdd_backing_rw(dev, batch, nr, first, WRITE))
+                sbdd_evict(dev, batch, nr, first);
+            for(i = 0; i < nr; i++)
+                put_page(batch->pages[i]);
+        }
+        cond_resched();
+    }
+
+    if(!atomic_read(&dev->deleting))
+        queue_delayed_work(__sbdd_wq, &dev->wb_work,
+                           msecs_to_jiffies(dev->cold_interval_ms));
+}
+
+/*
+ * Zoned device emulation. Zones are host managed: sequential zones are
+ * implicitly opened by the first write and must be written at the write
+ * pointer.
+ */
+
+static sector_t sbdd_zone_start(struct sbdd *dev, unsigned int idx)
+{
+    return (sector_t)idx << dev->zone_shift;
+}
+
+/*
+ * Open and close transitions happen under open_lock, which nests inside
+ * the zone locks. A zone is closed without taking its zone lock, so a
+ * write in flight to it completes and leaves the zone closed.
+ */
+
+/* Must be called with the zone locked */
+static void sbdd_zone_open(struct sbdd *dev, struct sbdd_zone *zone)
+{
+    struct sbdd_zone *victim;
+
+    spin_lock(&dev->open_lock);
+    if (dev->max_open && dev->nr_open == dev->max_open) {
+        /* Implicitly close the zone that was opened first */
+        victim = list_first_entry(&dev->open_zones, struct sbdd_zone, open_link);
+        list_del_init(&victim->open_link);
+        WRITE_ONCE(victim->cond, BLK_ZONE_COND_CLOSED);
+        dev->nr_open--;
+    }
+    list_add_tail(&zone->open_link, &dev->open_zones);
+    dev->nr_open++;
+    WRITE_ONCE(zone->cond, BLK_ZONE_COND_IMP_OPEN);
+    spin_unlock(&dev->open_lock);
+}
+
+/* Moves a zone to cond, must be called with the zone locked */
+static void sbdd_zone_leave_open(struct sbdd *dev, struct sbdd_zone *zone, u8 cond)
+{
+    spin_lock(&dev->open_lock);
+    if (!list_empty(&zone->open_link)) {
+        list_del_init(&zone->open_link);
+        dev->nr_open--;
+    }
+    WRITE_ONCE(zone->cond, cond);
+    spin_unlock(&dev->open_lock);
+}
+
+/*
+ * Checks a write against the zone it targets. For a sequential zone
+ * returns with the zone locked, sbdd_zone_write_end() unlocks it.
+ * Empty and closed zones are implicitly opened, which implicitly closes
+ * the oldest open zone when max_open zones are open already.
+ */
+static blk_status_t sbdd_zone_write_begin(struct sbdd *dev, sector_t pos, unsigned int nr_sects,
+                                          struct sbdd_zone **zonep)
+{
+    unsigned int idx = pos >> dev->zone_shift;
+    struct sbdd_zone *zone;
+
+    *zonep = NULL;
+    if (!nr_sects)
+        return BLK_STS_OK;
+    if (idx >= dev->nr_zones || ((pos + nr_sects - 1) >> dev->zone_shift) != idx)
+        return BLK_STS_IOERR;
+
+    zone = &dev->zones[idx];
+    if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL)
+        return BLK_STS_OK;
+
+    spin_lock(&zone->lock);
+    if (zone->cond == BLK_ZONE_COND_FULL || pos != zone->wp)
+        goto fail;
+    /* cond of an open zone may turn to closed meanwhile, that is fine */
+    if (READ_ONCE(zone->cond) != BLK_ZONE_COND_IMP_OPEN)
+        sbdd_zone_open(dev, zone);
+    *zonep = zone;
+    return BLK_STS_OK;
+
+    fail:
+    spin_unlock(&zone->lock);
+    return BLK_STS_IOERR;
+}
+
+static void sbdd_zone_write_end(struct sbdd *dev, struct sbdd_zone *zone, unsigned int nr_sects)
+{
+    if (!zone)
+        return;
+    zone->wp += nr_sects;
+    /* A failed write does not move the write pointer */
+    if (nr_sects && !(zone->wp & ((1 << dev->zone_shift) - 1)))
+        sbdd_zone_leave_open(dev, zone, BLK_ZONE_COND_FULL);
+    spin_unlock(&zone->lock);
+}
+
+/*
+ * Erases the page table entries of [first, last]. No I/O may reach the
+ * range, either because evict_sem is held for write or because it lies
+ * past the end of the device. May sleep.
+ */
+static void sbdd_drop_pages(struct sbdd *dev, struct xarray *xa, unsigned long first,
+                            unsigned long last, bool resident)
+{
+    unsigned long index = first;
+    unsigned long nr = 0;
+    void *entry;
+
+    for (entry = xa_find(xa, &index, last, XA_PRESENT); entry;
+         entry = xa_find_after(xa, &index, last, XA_PRESENT)) {
+        /* Writeback may have replaced the page meanwhile */
+        entry = xa_erase(xa, index);
+        if (++nr % SBDD_WB_BATCH == 0)
+            cond_resched();
+        if (!entry || xa_is_value(entry))
+            continue;
+        /* Writeback may still hold its own reference */
+        put_page(entry);
+        if (resident)
+            atomic_long_dec(&dev->resident_pages);
+    }
+}
+
+/* Must be called with evict_sem held for write */
+static void sbdd_zone_reset(struct sbdd *dev, unsigned int idx)
+{
+    struct sbdd_zone *zone = &dev->zones[idx];
+    sector_t start = sbdd_zone_start(dev, idx);
+    sector_t end = start + (1 << dev->zone_shift);
+
+    spin_lock(&zone->lock);
+    if (zone->cond == BLK_ZONE_COND_EMPTY) {
+        spin_unlock(&zone->lock);
+        return;
+    }
+    sbdd_zone_leave_open(dev, zone, BLK_ZONE_COND_EMPTY);
+    zone->wp = start;
+    spin_unlock(&zone->lock);
+
+    sbdd_drop_pages(dev, &dev->pages, start >> SBDD_PAGE_SECTORS_SHIFT,
+                    (end >> SBDD_PAGE_SECTORS_SHIFT) - 1, true);
+    sbdd_drop_pages(dev, &dev->pi, start >> SBDD_PI_PAGE_SHIFT,
+                    (end >> SBDD_PI_PAGE_SHIFT) - 1, false);
+}
+
+static bool sbdd_is_zone_mgmt(unsigned int op)
+{
+    return op == REQ_OP_ZONE_RESET || op == REQ_OP_ZONE_RESET_ALL;
+}
+
+/*
+ * Resetting frees the zone pages, so it waits for the I/O in flight.
+ * The 5.4 block layer has no explicit open, close and finish operations.
+ */
+static blk_status_t sbdd_zone_mgmt(struct sbdd *dev, unsigned int op, sector_t sector)
+{
+    blk_status_t status = BLK_STS_OK;
+    unsigned int idx = sector >> dev->zone_shift;
+
+    if (!dev->zones)
+        return BLK_STS_NOTSUPP;
+
+    down_write(&dev->evict_sem);
+    if (op == REQ_OP_ZONE_RESET_ALL) {
+        for (idx = 0; idx < dev->nr_zones; idx++)
+            if (dev->zones[idx].type == BLK_ZONE_TYPE_SEQWRITE_REQ)
+                sbdd_zone_reset(dev, idx);
+    } else if (idx >= dev->nr_zones || sector != sbdd_zone_start(dev, idx) ||
+               dev->zones[idx].type == BLK_ZONE_TYPE_CONVENTIONAL)
+        status = BLK_STS_IOERR;
+    else
+        sbdd_zone_reset(dev, idx);
+    up_write(&dev->evict_sem);
+
+    return status;
+}
+
+/*
+ * Protection information is kept per sector in the T10 Type 1 format.
+ * The block layer generates it for writes and verifies it for reads,
+ * the driver checks each written sector against its tuple as the sector
+ * is copied in, stores the tuples with the data and hands them back when
+ * data is copied out. If the block layer does not attach them the driver
+ * generates and verifies them on its own.
+ */
+
+/* Tuples a write carries, consumed sector by sector as data is copied in */
+struct sbdd_pi_src {
+    struct bio_integrity_payload    *bip;
+    struct bvec_iter                iter;
+    /* Tuples generated by the block layer from the same data need no check */
+    bool                            verify;
+};
+
+static void sbdd_pi_src_init(struct sbdd *dev, struct sbdd_pi_src *src, struct bio *bio)
+{
+    memset(src, 0, sizeof(struct sbdd_pi_src));
+#ifdef CONFIG_BLK_DEV_INTEGRITY
+    src->bip = dev->pi_csum ? bio_integrity(bio) : NULL;
+    if (src->bip) {
+        src->iter = src->bip->bip_iter;
+        src->verify = bio_data_dir(bio) && !(src->bip->bip_flags & BIP_BLOCK_INTEGRITY);
+    }
+#endif
+}
+
+static struct t10_pi_tuple *sbdd_pi_tuple(struct sbdd *dev, sector_t sector)
+{
+    struct page *page = xa_load(&dev->pi, sector >> SBDD_PI_PAGE_SHIFT);
+    if (!page)
+        return NULL;
+    return (struct t10_pi_tuple *)page_address(page) +
+           (sector & ((1 << SBDD_PI_PAGE_SHIFT) - 1));
+}
+
+/* Hands the stored tuples of a read back in the integrity payload of the bio */
+static void sbdd_pi_copy(struct sbdd *dev, struct bio *bio)
+{
+#ifdef CONFIG_BLK_DEV_INTEGRITY
+    struct bio_integrity_payload *bip = bio_integrity(bio);
+    sector_t sector = bio->bi_iter.bi_sector;
+    struct t10_pi_tuple *pi;
+    struct bvec_iter iter;
+    struct bio_vec bv;
+    unsigned int off;
+    void *map;
+
+    if (!bip)
+        return;
+
+    if (!dev->zones)
+        spin_lock(&dev->datalock);
+    bip_for_each_vec(bv, bip, iter) {
+        map = kmap_atomic(bv.bv_page);
+        for (off = 0; off < bv.bv_len; off += sizeof(struct t10_pi_tuple), sector++) {
+            pi = sbdd_pi_tuple(dev, sector);
+            if (pi)
+                memcpy(map + bv.bv_offset + off, pi, sizeof(struct t10_pi_tuple));
+            else
+                memset(map + bv.bv_offset + off, 0xff, sizeof(struct t10_pi_tuple));
+        }
+        kunmap_atomic(map);
+    }
+    if (!dev->zones)
+        spin_unlock(&dev->datalock);
+#endif
+}
+
+/* Checks a sector against its tuple, escape tuples match anything */
+static bool sbdd_pi_mismatch(struct sbdd *dev, const struct t10_pi_tuple *pi,
+                             void *buff, sector_t sector)
+{
+    if (pi->app_tag == T10_PI_APP_ESCAPE)
+        return false;
+    if (pi->guard_tag == dev->pi_csum(buff, SBDD_SECTOR_SIZE) &&
+        be32_to_cpu(pi->ref_tag) == lower_32_bits(sector))
+        return false;
+    pr_err_ratelimited("%s: protection information mismatch at sector %llu\n",
+                       dev->name, (unsigned long long)sector);
+    return true;
+}
+
+/*
+ * Copies written sectors in along with the tuples the bio carries. Each
+ * sector is checked against its tuple right before it is stored, the
+ * copy stops at the first mismatch so no sector is stored without a
+ * matching tuple.
+ */
+static blk_status_t sbdd_pi_write(struct sbdd *dev, struct sbdd_pi_src *src, void *dst,
+                                  void *buff, sector_t sector, size_t nbytes)
+{
+#ifdef CONFIG_BLK_DEV_INTEGRITY
+    struct t10_pi_tuple tuple;
+    struct t10_pi_tuple *pi;
+    struct bio_vec bv;
+    void *map;
+
+    for (; nbytes; nbytes -= SBDD_SECTOR_SIZE, dst += SBDD_SECTOR_SIZE,
+         buff += SBDD_SECTOR_SIZE, sector++) {
+        if (src->iter.bi_size < sizeof(struct t10_pi_tuple))
+            return BLK_STS_PROTECTION;
+        bv = bvec_iter_bvec(src->bip->bip_vec, src->iter);
+        map = kmap_atomic(bv.bv_page);
+        memcpy(&tuple, map + bv.bv_offset, sizeof(struct t10_pi_tuple));
+        kunmap_atomic(map);
+        bvec_iter_advance(src->bip->bip_vec, &src->iter, sizeof(struct t10_pi_tuple));
+
+        if (src->verify && sbdd_pi_mismatch(dev, &tuple, buff, sector))
+            return BLK_STS_PROTECTION;
+        memcpy(dst, buff, SBDD_SECTOR_SIZE);
+        pi = sbdd_pi_tuple(dev, sector);
+        if (pi)
+            *pi = tuple;
+    }
+#endif
+    return BLK_STS_OK;
+}
+
+/*
+ * Generates the tuples of the sectors just written, or checks the
+ * sectors just read against their tuples. Only used for bios that carry
+ * no tuples of their own.
+ */
+static blk_status_t sbdd_pi_check(struct sbdd *dev, void *buff, sector_t sector,
+                                  size_t nbytes, int dir)
+{
+    blk_status_t status = BLK_STS_OK;
+    struct t10_pi_tuple *pi;
+
+    for (; nbytes; nbytes -= SBDD_SECTOR_SIZE, buff += SBDD_SECTOR_SIZE, sector++) {
+        pi = sbdd_pi_tuple(dev, sector);
+        if (!pi)
+            continue;
+        if (dir) {
+            pi->guard_tag = dev->pi_csum(buff, SBDD_SECTOR_SIZE);
+            pi->app_tag = 0;
+            pi->ref_tag = cpu_to_be32(lower_32_bits(sector));
+        } else if (sbdd_pi_mismatch(dev, pi, buff, sector))
+            status = BLK_STS_PROTECTION;
+    }
+    return status;
+}
+
+/*
+ * Copies a single page segment. Pages of the bio may be highmem and are
+ * mapped, pages of the device are allocated from lowmem.
+ */
+static sector_t sbdd_xfer(struct bio_vec* bvec, sector_t pos, int dir, struct sbdd *dev,
+                          struct sbdd_pi_src *src, blk_status_t *status)
+{
+	void *map;
+	void *buff;
 	sector_t len = bvec->bv_len >> SBDD_SECTOR_SHIFT;
 	size_t offset;
 	size_t nbytes;
-
-    if (pos + len > dev->capacity){
-        len = dev->capacity - pos;
+	size_t chunk;
+	struct page *page;
+	sector_t cur = pos;
+	sector_t capacity = READ_ONCE(dev->capacity);
+
+    /* The device may have been shrunk while the bio was in flight */
+    if (pos >= capacity)
+        len = 0;
+    else if (pos + len > capacity){
+        len = capacity - pos;
     }
 
-	offset = pos << SBDD_SECTOR_SHIFT;
 	nbytes = len << SBDD_SECTOR_SHIFT;
 
-    spin_lock(&dev->datalock);
-
-    if (dir)
-        memcpy(dev->data + offset, buff, nbytes);
-	else
-        memcpy(buff, dev->data + offset, nbytes);
+    /*
+     * Pages stay in the table while evict_sem is held for read and
+     * xa_load() is RCU safe, so zoned devices go without the device wide
+     * lock. Writes to a sequential zone are ordered by the zone lock.
+     */
+    if (!dev->zones)
+        spin_lock(&dev->datalock);
+
+    map = kmap_atomic(bvec->bv_page);
+    buff = map + bvec->bv_offset;
+
+    /* A segment may span two device pages */
+    while (nbytes) {
+        offset = (cur << SBDD_SECTOR_SHIFT) & ~PAGE_MASK;
+        chunk = min_t(size_t, nbytes, PAGE_SIZE - offset);
+        page = xa_load(&dev->pages, cur >> SBDD_PAGE_SECTORS_SHIFT);
+
+        if (page)
+            page->private = jiffies;
+        if (dir && src && src->bip) {
+            /* Nothing past a mismatching sector is stored */
+            if (!*status && !WARN_ON_ONCE(!page))
+                *status = sbdd_pi_write(dev, src, page_address(page) + offset,
+                                        buff, cur, chunk);
+        } else if (dir) {
+            if (!WARN_ON_ONCE(!page))
+                memcpy(page_address(page) + offset, buff, chunk);
+        } else if (page)
+            memcpy(buff, page_address(page) + offset, chunk);
+        else
+            memset(buff, 0, chunk);
+
+        /* Reads with a payload are verified by the block layer */
+        if (dev->pi_csum && !(src && src->bip) &&
+            sbdd_pi_check(dev, buff, cur, chunk, dir))
+            *status = BLK_STS_PROTECTION;
+
+        buff += chunk;
+        cur += chunk >> SBDD_SECTOR_SHIFT;
+        nbytes -= chunk;
+    }
 
-    spin_unlock(&dev->datalock);
+    kunmap_atomic(map);
+    if (!dev->zones)
+        spin_unlock(&dev->datalock);
 
 	pr_debug("pos=%6llu len=%4llu %s\n", pos, len, dir ? "written" : "read");
 
 	return len;
 }
 
+/*
+ * Composite devices stripe (RAID0) or mirror (RAID1) their data over the
+ * member devices. Segments are split by hand and copied with sbdd_xfer()
+ * of the members, no bios are cloned.
+ */
+
+/* Maps a sector of a striped device, returns the sectors left in its chunk */
+static sector_t sbdd_stripe_map(struct sbdd *dev, sector_t pos,
+                                struct sbdd **member, sector_t *mpos)
+{
+    sector_t chunk = pos >> dev->chunk_shift;
+    sector_t off = pos & (((sector_t)1 << dev->chunk_shift) - 1);
+
+    *member = dev->members[sector_div(chunk, dev->nr_members)];
+    *mpos = (chunk << dev->chunk_shift) + off;
+    return ((sector_t)1 << dev->chunk_shift) - off;
+}
+
+/*
+ * Allocates the member pages of a write, or picks the mirror a read is
+ * served from. Members have no backing file, so nothing is evicted.
+ */
+static blk_status_t sbdd_compose_prepare(struct sbdd *dev, sector_t pos, unsigned int nr_sects,
+                                         int dir, struct sbdd **mirror)
+{
+    struct sbdd *member;
+    sector_t mpos, len;
+    unsigned int i;
+
+    *mirror = NULL;
+    if (!dir) {
+        if (dev->layout == SBDD_MIRRORED)
+            *mirror = dev->members[(unsigned int)atomic_inc_return(&dev->next_mirror) %
+                                   dev->nr_members];
+        return BLK_STS_OK;
+    }
+
+    if (dev->layout == SBDD_MIRRORED) {
+        for (i = 0; i < dev->nr_members; i++)
+            if (sbdd_alloc_range(dev->members[i], pos, nr_sects))
+                return BLK_STS_RESOURCE;
+        return BLK_STS_OK;
+    }
+
+    while (nr_sects) {
+        len = min_t(sector_t, nr_sects, sbdd_stripe_map(dev, pos, &member, &mpos));
+        if (sbdd_alloc_range(member, mpos, len))
+            return BLK_STS_RESOURCE;
+        pos += len;
+        nr_sects -= len;
+    }
+    return BLK_STS_OK;
+}
+
+static sector_t sbdd_compose_xfer(struct bio_vec *bvec, sector_t pos, int dir, struct sbdd *dev,
+                                  struct sbdd *mirror, blk_status_t *status)
+{
+    sector_t len = bvec->bv_len >> SBDD_SECTOR_SHIFT;
+    struct bio_vec piece = *bvec;
+    struct sbdd *member;
+    sector_t done, mpos;
+    unsigned int i;
+
+    if (dev->layout == SBDD_MIRRORED) {
+        if (mirror)
+            return sbdd_xfer(bvec, pos, dir, mirror, NULL, status);
+        for (i = 0; i < dev->nr_members; i++)
+            sbdd_xfer(bvec, pos, dir, dev->members[i], NULL, status);
+        return len;
+    }
+
+    for (done = 0; done < len; done += piece.bv_len >> SBDD_SECTOR_SHIFT) {
+        piece.bv_offset = bvec->bv_offset + (done << SBDD_SECTOR_SHIFT);
+        piece.bv_len = min_t(sector_t, len - done,
+                             sbdd_stripe_map(dev, pos + done, &member, &mpos)) << SBDD_SECTOR_SHIFT;
+        sbdd_xfer(&piece, mpos, dir, member, NULL, status);
+    }
+    return len;
+}
+
 #ifdef BLK_MQ_MODE
 
-static void sbdd_xfer_rq(struct request *rq, struct sbdd *dev)
+static blk_status_t sbdd_compose_rq(struct sbdd *dev, struct request *rq)
+{
+	struct req_iterator iter;
+	struct bio_vec bvec;
+	int dir = rq_data_dir(rq);
+	sector_t pos = blk_rq_pos(rq);
+	struct sbdd *mirror;
+	blk_status_t status;
+
+    status = sbdd_compose_prepare(dev, pos, blk_rq_sectors(rq), dir, &mirror);
+    if (status)
+        return status;
+
+	rq_for_each_segment(bvec, rq, iter)
+        pos += sbdd_compose_xfer(&bvec, pos, dir, dev, mirror, &status);
+
+	return status;
+}
+
+static blk_status_t sbdd_xfer_rq(struct request *rq, struct sbdd *dev)
+{
+	struct req_iterator iter;
+	struct bio_vec bvec;
+	struct bio *bio = NULL;
+	struct sbdd_pi_src src;
+	int dir = rq_data_dir(rq);
+	sector_t pos = blk_rq_pos(rq);
+	blk_status_t status = BLK_STS_OK;
+
+	rq_for_each_segment(bvec, rq, iter) {
+        /* Every bio carries its own payload */
+        if (iter.bio != bio) {
+            bio = iter.bio;
+            sbdd_pi_src_init(dev, &src, bio);
+        }
+        pos += sbdd_xfer(&bvec, pos, dir, dev, &src, &status);
+    }
+
+    if (!dir)
+        __rq_for_each_bio(bio, rq)
+            sbdd_pi_copy(dev, bio);
+
+	return status;
+}
+
+/* Must be called with evict_sem held for read */
+static void sbdd_process_rq(struct sbdd *dev, struct request *rq)
+{
+    if (rq_data_dir(rq) &&
+        sbdd_alloc_range(dev, blk_rq_pos(rq), blk_rq_sectors(rq))) {
+        blk_mq_end_request(rq, BLK_STS_IOERR);
+        return;
+    }
+
+    if (dev->zones) {
+        struct sbdd_zone *zone = NULL;
+        blk_status_t status = BLK_STS_OK;
+
+        if (rq_data_dir(rq))
+            status = sbdd_zone_write_begin(dev, blk_rq_pos(rq), blk_rq_sectors(rq), &zone);
+        if (!status) {
+            status = sbdd_xfer_rq(rq, dev);
+            sbdd_zone_write_end(dev, zone, status ? 0 : blk_rq_sectors(rq));
+        }
+        blk_mq_end_request(rq, status);
+        return;
+    }
+
+    spin_lock(&dev->transferring);
+    blk_mq_end_request(rq, sbdd_xfer_rq(rq, dev));
+    spin_unlock(&dev->transferring);
+}
+
+static void sbdd_fault_work(struct work_struct *work)
 {
-	struct req_iterator iter;
-	struct bio_vec bvec;
-	int dir = rq_data_dir(rq);
-	sector_t pos = blk_rq_pos(rq);
+    struct sbdd *dev = container_of(work, struct sbdd, fault_work);
+    struct sbdd_cmd *cmd;
+    struct request *rq;
+
+    for (;;) {
+        spin_lock(&dev->fault_lock);
+        cmd = list_first_entry_or_null(&dev->fault_rqs, struct sbdd_cmd, list);
+        if (cmd)
+            list_del_init(&cmd->list);
+        spin_unlock(&dev->fault_lock);
+        if (!cmd)
+            break;
 
-	rq_for_each_segment(bvec, rq, iter)
-        pos += sbdd_xfer(&bvec, pos, dir, dev);
+        rq = blk_mq_rq_from_pdu(cmd);
+        down_read(&dev->evict_sem);
+        if (atomic_read(&dev->deleting) ||
+            sbdd_fault_in(dev, blk_rq_pos(rq), blk_rq_sectors(rq), dev->fault_batch))
+            blk_mq_end_request(rq, BLK_STS_IOERR);
+        else
+            sbdd_process_rq(dev, rq);
+        up_read(&dev->evict_sem);
+        sbdd_put_ref(dev);
+    }
 }
 
 static blk_status_t sbdd_queue_rq(struct blk_mq_hw_ctx *hctx,
                                   struct blk_mq_queue_data const *bd)
 {
-    struct sbdd *dev = bd->rq->rq_disk->private_data;
+    struct request *rq = bd->rq;
+    struct sbdd *dev = rq->rq_disk->private_data;
+    struct sbdd_cmd *cmd = blk_mq_rq_to_pdu(rq);
     if (atomic_read(&dev->deleting))
 		return BLK_STS_IOERR;
 
-    spin_lock(&dev->transferring);
-
     atomic_inc(&dev->refs_cnt);
-    blk_mq_start_request(bd->rq);
-    sbdd_xfer_rq(bd->rq, dev);
-    blk_mq_end_request(bd->rq, BLK_STS_OK);
+    blk_mq_start_request(rq);
 
-    if (atomic_dec_and_test(&dev->refs_cnt))
-        wake_up(&dev->exitwait);
+    if (sbdd_is_zone_mgmt(req_op(rq))) {
+        blk_mq_end_request(rq, sbdd_zone_mgmt(dev, req_op(rq), blk_rq_pos(rq)));
+        sbdd_put_ref(dev);
+        return BLK_STS_OK;
+    }
 
-    spin_unlock(&dev->transferring);
+    if (dev->members) {
+        blk_mq_end_request(rq, sbdd_compose_rq(dev, rq));
+        sbdd_put_ref(dev);
+        return BLK_STS_OK;
+    }
+
+    down_read(&dev->evict_sem);
+    if (sbdd_range_resident(dev, blk_rq_pos(rq), blk_rq_sectors(rq))) {
+        sbdd_process_rq(dev, rq);
+        up_read(&dev->evict_sem);
+        sbdd_put_ref(dev);
+        return BLK_STS_OK;
+    }
+    up_read(&dev->evict_sem);
+
+    /* Reading the backing file sleeps, so the request is completed later */
+    spin_lock(&dev->fault_lock);
+    list_add_tail(&cmd->list, &dev->fault_rqs);
+    spin_unlock(&dev->fault_lock);
+    queue_work(__sbdd_wq, &dev->fault_work);
 
     return BLK_STS_OK;
 }
@@ -418,45 +1700,184 @@ static struct blk_mq_ops const __sbdd_blk_mq_ops = {
 
 #else
 
-static void sbdd_xfer_bio(struct bio *bio, struct sbdd *dev)
+static void sbdd_compose_bio(struct sbdd *dev, struct bio *bio)
+{
+	struct bvec_iter iter;
+	struct bio_vec bvec;
+	int dir = bio_data_dir(bio);
+	sector_t pos = bio->bi_iter.bi_sector;
+	struct sbdd *mirror;
+
+    bio->bi_status = sbdd_compose_prepare(dev, pos, bio_sectors(bio), dir, &mirror);
+    if (!bio->bi_status)
+        bio_for_each_segment(bvec, bio, iter)
+            pos += sbdd_compose_xfer(&bvec, pos, dir, dev, mirror, &bio->bi_status);
+    bio_endio(bio);
+}
+
+static blk_status_t sbdd_xfer_bio(struct bio *bio, struct sbdd *dev)
 {
 	struct bvec_iter iter;
 	struct bio_vec bvec;
 	int dir = bio_data_dir(bio);
 	sector_t pos = bio->bi_iter.bi_sector;
+	struct sbdd_pi_src src;
+	blk_status_t status = BLK_STS_OK;
+
+    sbdd_pi_src_init(dev, &src, bio);
 
 	bio_for_each_segment(bvec, bio, iter)
-        pos += sbdd_xfer(&bvec, pos, dir, dev);
+        pos += sbdd_xfer(&bvec, pos, dir, dev, &src, &status);
+
+    if (!dir)
+        sbdd_pi_copy(dev, bio);
+
+	return status;
+}
+
+/* Must be called with evict_sem held for read */
+static void sbdd_process_bio(struct sbdd *dev, struct bio *bio)
+{
+    if (bio_data_dir(bio) &&
+        sbdd_alloc_range(dev, bio->bi_iter.bi_sector, bio_sectors(bio))) {
+        bio_io_error(bio);
+        return;
+    }
+
+    if (dev->zones) {
+        struct sbdd_zone *zone = NULL;
+
+        if (bio_data_dir(bio))
+            bio->bi_status = sbdd_zone_write_begin(dev, bio->bi_iter.bi_sector,
+                                                   bio_sectors(bio), &zone);
+        if (!bio->bi_status) {
+            bio->bi_status = sbdd_xfer_bio(bio, dev);
+            sbdd_zone_write_end(dev, zone, bio->bi_status ? 0 : bio_sectors(bio));
+        }
+        bio_endio(bio);
+        return;
+    }
+
+    spin_lock(&dev->transferring);
+    bio->bi_status = sbdd_xfer_bio(bio, dev);
+	bio_endio(bio);
+    spin_unlock(&dev->transferring);
+}
+
+static void sbdd_fault_work(struct work_struct *work)
+{
+    struct sbdd *dev = container_of(work, struct sbdd, fault_work);
+    struct bio *bio;
+
+    for (;;) {
+        spin_lock(&dev->fault_lock);
+        bio = bio_list_pop(&dev->fault_bios);
+        spin_unlock(&dev->fault_lock);
+        if (!bio)
+            break;
+
+        down_read(&dev->evict_sem);
+        if (atomic_read(&dev->deleting) ||
+            sbdd_fault_in(dev, bio->bi_iter.bi_sector, bio_sectors(bio), dev->fault_batch))
+            bio_io_error(bio);
+        else
+            sbdd_process_bio(dev, bio);
+        up_read(&dev->evict_sem);
+        sbdd_put_ref(dev);
+    }
 }
 
 static blk_qc_t sbdd_make_request(struct request_queue *q, struct bio *bio)
 {
     struct sbdd *dev = bio->bi_disk->private_data;
-    spin_lock(&dev->transferring);
     if (atomic_read(&dev->deleting)){
-        spin_unlock(&dev->transferring);
-		return BLK_STS_IOERR;
+        bio_io_error(bio);
+		return BLK_QC_T_NONE;
     }
 
+    /* Attaches generated protection information, ends the bio on failure */
+    if (!bio_integrity_prep(bio))
+        return BLK_QC_T_NONE;
+
     atomic_inc(&dev->refs_cnt);
-    sbdd_xfer_bio(bio, dev);
-	bio_endio(bio);
 
-    if (atomic_dec_and_test(&dev->refs_cnt))
-        wake_up(&dev->exitwait);
+    if (sbdd_is_zone_mgmt(bio_op(bio))) {
+        bio->bi_status = sbdd_zone_mgmt(dev, bio_op(bio), bio->bi_iter.bi_sector);
+        bio_endio(bio);
+        sbdd_put_ref(dev);
+        return BLK_QC_T_NONE;
+    }
 
-    spin_unlock(&dev->transferring);
-    return BLK_STS_OK;
+    if (dev->members) {
+        sbdd_compose_bio(dev, bio);
+        sbdd_put_ref(dev);
+        return BLK_QC_T_NONE;
+    }
+
+    down_read(&dev->evict_sem);
+    if (sbdd_range_resident(dev, bio->bi_iter.bi_sector, bio_sectors(bio))) {
+        sbdd_process_bio(dev, bio);
+        up_read(&dev->evict_sem);
+        sbdd_put_ref(dev);
+        return BLK_QC_T_NONE;
+    }
+    up_read(&dev->evict_sem);
+
+    /* Reading the backing file sleeps, so let the submitter go meanwhile */
+    spin_lock(&dev->fault_lock);
+    bio_list_add(&dev->fault_bios, bio);
+    spin_unlock(&dev->fault_lock);
+    queue_work(__sbdd_wq, &dev->fault_work);
+
+    return BLK_QC_T_NONE;
 }
 
 #endif /* BLK_MQ_MODE */
 
+static int sbdd_report_zones(struct gendisk *disk, sector_t sector,
+                             struct blk_zone *zones, unsigned int *nr_zones)
+{
+    struct sbdd *dev = disk->private_data;
+    unsigned int first = sector >> dev->zone_shift;
+    struct sbdd_zone *zone;
+    unsigned int i;
+
+    if (!dev->zones)
+        return -EOPNOTSUPP;
+
+    *nr_zones = first < dev->nr_zones ? min(*nr_zones, dev->nr_zones - first) : 0;
+    for (i = 0; i < *nr_zones; i++) {
+        zone = &dev->zones[first + i];
+        memset(&zones[i], 0, sizeof(struct blk_zone));
+        zones[i].start = sbdd_zone_start(dev, first + i);
+        zones[i].len = 1 << dev->zone_shift;
+        zones[i].type = zone->type;
+        spin_lock(&zone->lock);
+        zones[i].wp = zone->wp;
+        zones[i].cond = READ_ONCE(zone->cond);
+        spin_unlock(&zone->lock);
+    }
+    return 0;
+}
+
 /*
 There are no read or write operations. These operations are performed by
 the request() function associated with the request queue of the disk.
 */
+/* Members of a composite device cannot be opened for writing */
+static int sbdd_open(struct block_device *bdev, fmode_t mode)
+{
+    struct sbdd *dev = bdev->bd_disk->private_data;
+
+    if ((mode & FMODE_WRITE) && READ_ONCE(dev->holder))
+        return -EBUSY;
+    return 0;
+}
+
 static struct block_device_operations const __sbdd_bdev_ops = {
 	.owner = THIS_MODULE,
+	.open = sbdd_open,
+	.report_zones = sbdd_report_zones,
 };
 
 /*
@@ -467,6 +1888,118 @@ static struct block_device_operations const __sbdd_bdev_ops = {
 static void sbdd_device_release(struct device *dev)
 {}
 
+/*
+ * Per-device attributes of the sysfs entry
+ */
+
+static struct sbdd *sbdd_by_device(struct device *d)
+{
+    int i;
+    for(i = 0; i < MAX_DEVICES; i++)
+        if(__devices[i].dev == d)
+            return &__devices[i];
+    return NULL;
+}
+
+static ssize_t resident_pages_show(struct device *d, struct device_attribute *attr,
+                                   char *buf)
+{
+    struct sbdd *dev = sbdd_by_device(d);
+    return sprintf(buf, "%ld\n", atomic_long_read(&dev->resident_pages));
+}
+
+static ssize_t writeback_pages_show(struct device *d, struct device_attribute *attr,
+                                    char *buf)
+{
+    struct sbdd *dev = sbdd_by_device(d);
+    return sprintf(buf, "%ld\n", atomic_long_read(&dev->writeback_pages));
+}
+
+static ssize_t faultin_pages_show(struct device *d, struct device_attribute *attr,
+                                  char *buf)
+{
+    struct sbdd *dev = sbdd_by_device(d);
+    return sprintf(buf, "%ld\n", atomic_long_read(&dev->faultin_pages));
+}
+
+static ssize_t mem_limit_mib_show(struct device *d, struct device_attribute *attr,
+                                  char *buf)
+{
+    struct sbdd *dev = sbdd_by_device(d);
+    return sprintf(buf, "%lu\n", dev->mem_limit_pages / SBDD_MIB_PAGES);
+}
+
+static ssize_t mem_limit_mib_store(struct device *d, struct device_attribute *attr,
+                                   const char *buf, size_t count)
+{
+    struct sbdd *dev = sbdd_by_device(d);
+    unsigned long limit_mib;
+    int ret = kstrtoul(buf, 10, &limit_mib);
+    if(ret)
+        return ret;
+    dev->mem_limit_pages = limit_mib * SBDD_MIB_PAGES;
+    if(sbdd_over_limit(dev))
+        mod_delayed_work(__sbdd_wq, &dev->wb_work, 0);
+    return count;
+}
+
+static ssize_t cold_interval_ms_show(struct device *d, struct device_attribute *attr,
+                                     char *buf)
+{
+    struct sbdd *dev = sbdd_by_device(d);
+    return sprintf(buf, "%u\n", dev->cold_interval_ms);
+}
+
+static ssize_t cold_interval_ms_store(struct device *d, struct device_attribute *attr,
+                                      const char *buf, size_t count)
+{
+    struct sbdd *dev = sbdd_by_device(d);
+    unsigned int interval;
+    int ret = kstrtouint(buf, 10, &interval);
+    if(ret)
+        return ret;
+    if(!interval)
+        return -EINVAL;
+    dev->cold_interval_ms = interval;
+    mod_delayed_work(__sbdd_wq, &dev->wb_work, msecs_to_jiffies(interval));
+    return count;
+}
+
+static DEVICE_ATTR_RO(resident_pages);
+static DEVICE_ATTR_RO(writeback_pages);
+static DEVICE_ATTR_RO(faultin_pages);
+static DEVICE_ATTR_RW(mem_limit_mib);
+static DEVICE_ATTR_RW(cold_interval_ms);
+
+static struct attribute *sbdd_dev_attrs[] = {
+    &dev_attr_resident_pages.attr,
+    &dev_attr_writeback_pages.attr,
+    &dev_attr_faultin_pages.attr,
+    &dev_attr_mem_limit_mib.attr,
+    &dev_attr_cold_interval_ms.attr,
+    NULL
+};
+
+/* Writeback attributes make sense only for devices with a backing file */
+static umode_t sbdd_dev_attr_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+    struct sbdd *dev = sbdd_by_device(kobj_to_dev(kobj));
+    /* resident_pages shows the memory use of any device */
+    if(attr != &dev_attr_resident_pages.attr && (!dev || !dev->backing))
+        return 0;
+    return attr->mode;
+}
+
+static const struct attribute_group sbdd_dev_group = {
+    .attrs = sbdd_dev_attrs,
+    .is_visible = sbdd_dev_attr_visible
+};
+
+static const struct attribute_group *sbdd_dev_groups[] = {
+    &sbdd_dev_group,
+    NULL
+};
+
 static int sbdd_device_register(struct sbdd *dev, char* name)
 {
     int ret = 0;
@@ -481,6 +2014,7 @@ static int sbdd_device_register(struct sbdd *dev, char* name)
     dev->dev->bus = &sbdd_bus_type;
     dev->dev->parent = &sbdd_bus;
     dev->dev->release = sbdd_device_release;
+    dev->dev->groups = sbdd_dev_groups;
     ret = device_register(dev->dev);
     if(ret)
         pr_err("registering %s failed with code %d\n", name, ret);
@@ -489,47 +2023,381 @@ static int sbdd_device_register(struct sbdd *dev, char* name)
 
 static void sbdd_device_unregister(struct sbdd *dev)
 {
-    device_unregister(dev->dev);
-    kvfree(dev->dev);
+    if (dev->dev) {
+        device_unregister(dev->dev);
+        kvfree(dev->dev);
+    }
+    kvfree(dev->name);
+}
+
+static void sbdd_free_pages(struct sbdd *dev)
+{
+    unsigned long index;
+    void *entry;
+
+    pr_info("freeing data\n");
+    xa_for_each(&dev->pages, index, entry)
+        if (!xa_is_value(entry))
+            __free_page(entry);
+    xa_destroy(&dev->pages);
+
+    xa_for_each(&dev->pi, index, entry)
+        __free_page(entry);
+    xa_destroy(&dev->pi);
+}
+
+/* Frees everything but the disk, the queue and the sysfs entry */
+static void sbdd_release(struct sbdd *dev)
+{
+    unsigned int i;
+
+    cancel_delayed_work_sync(&dev->wb_work);
+    flush_work(&dev->fault_work);
+    sbdd_free_pages(dev);
+
+    if (dev->backing) {
+        pr_info("closing backing file\n");
+        filp_close(dev->backing, NULL);
+    }
+    kfree(dev->wb_batch);
+    kfree(dev->fault_batch);
+    kvfree(dev->zones);
+    if (dev->members) {
+        for (i = 0; i < dev->nr_members; i++) {
+            set_disk_ro(dev->members[i]->gd, dev->members[i]->was_ro);
+            WRITE_ONCE(dev->members[i]->holder, NULL);
+        }
+        kfree(dev->members);
+    }
+    memset(dev, 0, sizeof(struct sbdd));
+}
+
+static bool sbdd_backing_fits(struct sbdd *dev, sector_t capacity)
+{
+    return !S_ISBLK(file_inode(dev->backing)->i_mode) ||
+           i_size_read(dev->backing->f_mapping->host) >= ((loff_t)capacity << SBDD_SECTOR_SHIFT);
+}
+
+static int sbdd_backing_setup(struct sbdd *dev, const struct sbdd_opts *opts)
+{
+    struct file *file;
+
+    /*
+     * Direct I/O keeps written back pages out of the page cache, otherwise
+     * eviction would only move them there. Batches are whole pages at page
+     * aligned offsets, which any file system doing direct I/O accepts.
+     */
+    pr_info("opening backing file %s\n", opts->backing_path);
+    file = filp_open(opts->backing_path, O_RDWR | O_CREAT | O_LARGEFILE | O_DIRECT, 0600);
+    if (IS_ERR(file)) {
+        if (PTR_ERR(file) == -EINVAL)
+            pr_err("backing file does not support direct I/O\n");
+        else
+            pr_err("unable to open backing file, error %ld\n", PTR_ERR(file));
+        return PTR_ERR(file);
+    }
+    /* Closed by sbdd_release() if the setup fails later on */
+    dev->backing = file;
+    if (!sbdd_backing_fits(dev, dev->capacity)) {
+        pr_err("backing partition is smaller than the device\n");
+        return -EINVAL;
+    }
+
+    dev->wb_batch = kmalloc(sizeof(struct sbdd_batch), GFP_KERNEL);
+    dev->fault_batch = kmalloc(sizeof(struct sbdd_batch), GFP_KERNEL);
+    if (!dev->wb_batch || !dev->fault_batch) {
+        pr_err("unable to alloc writeback batches\n");
+        return -ENOMEM;
+    }
+
+    dev->mem_limit_pages = (unsigned long)opts->mem_limit_mib * SBDD_MIB_PAGES;
+    dev->cold_interval_ms = opts->cold_interval_ms;
+    queue_delayed_work(__sbdd_wq, &dev->wb_work, msecs_to_jiffies(dev->cold_interval_ms));
+    return 0;
+}
+
+/*
+ * Data is stored page by page, so growing only moves the end of the
+ * device and shrinking drops the pages past the new end. I/O to the
+ * rest of the device is not paused, evict_sem only fences the I/O that
+ * was already in flight.
+ */
+static int sbdd_resize(struct sbdd *dev, unsigned long capacity_mib)
+{
+    sector_t capacity = (sector_t)capacity_mib * SBDD_MIB_SECTORS;
+    char *envp[] = {"RESIZE=1", NULL};
+
+    if (!capacity) {
+        pr_err("device capacity must be positive\n");
+        return -EINVAL;
+    }
+    if (dev->backing && !sbdd_backing_fits(dev, capacity)) {
+        pr_err("backing partition is smaller than the device\n");
+        return -EINVAL;
+    }
+    if (dev->zones) {
+        pr_err("zoned devices cannot be resized\n");
+        return -EOPNOTSUPP;
+    }
+    if (dev->members || dev->holder) {
+        pr_err("composite devices and their members cannot be resized\n");
+        return -EOPNOTSUPP;
+    }
+
+    if (capacity >= dev->capacity) {
+        dev->capacity = capacity;
+        set_capacity(dev->gd, capacity);
+    } else {
+        /* New I/O past the end is rejected by the block layer from now on */
+        set_capacity(dev->gd, capacity);
+        dev->capacity = capacity;
+
+        /*
+         * Waits for I/O that has already passed the old end check. Later
+         * I/O is clamped to the new capacity and never reaches the pages
+         * dropped below. Commands are serialized, so no grow can race them.
+         */
+        down_write(&dev->evict_sem);
+        up_write(&dev->evict_sem);
+
+        sbdd_drop_pages(dev, &dev->pages, capacity >> SBDD_PAGE_SECTORS_SHIFT,
+                        ULONG_MAX, true);
+        /* Stale tuples would fail reads of the range once it is grown back */
+        sbdd_drop_pages(dev, &dev->pi, capacity >> SBDD_PI_PAGE_SHIFT,
+                        ULONG_MAX, false);
+    }
+
+    revalidate_disk(dev->gd);
+    kobject_uevent_env(&disk_to_dev(dev->gd)->kobj, KOBJ_CHANGE, envp);
+    return 0;
+}
+
+/*
+ * Checks the members of a composite device and returns its capacity, or
+ * 0 if they cannot be composed. Called before a device slot is taken.
+ */
+static sector_t sbdd_compose_capacity(const struct sbdd_opts *opts)
+{
+    sector_t member_capacity = 0;
+    sector_t capacity;
+    struct sbdd *member;
+    unsigned int i, j;
+
+    for (i = 0; i < opts->nr_members; i++) {
+        member = opts->members[i];
+        if (member->members || member->holder || member->backing ||
+            member->zones || member->pi_csum || atomic_read(&member->deleting)) {
+            pr_err("device %s cannot be a member\n", member->name);
+            return 0;
+        }
+        for (j = 0; j < i; j++)
+            if (opts->members[j] == member) {
+                pr_err("device %s is listed twice\n", member->name);
+                return 0;
+            }
+        if (!i || member->capacity < member_capacity)
+            member_capacity = member->capacity;
+    }
+
+    if (opts->layout == SBDD_STRIPED)
+        capacity = round_down(member_capacity, (sector_t)1 << opts->chunk_shift) *
+                   opts->nr_members;
+    else
+        capacity = member_capacity;
+    if (!capacity)
+        pr_err("members are smaller than a chunk\n");
+    return capacity;
+}
+
+/*
+ * Tells whether the disk is open. Opens that raced with setting the
+ * holder either show up in bd_openers, which is updated under bd_mutex,
+ * or are refused by sbdd_open().
+ */
+static bool sbdd_is_open(struct sbdd *dev)
+{
+    struct block_device *bdev = bdget_disk(dev->gd, 0);
+    bool open;
+
+    if (!bdev)
+        return true;
+    mutex_lock(&bdev->bd_mutex);
+    open = bdev->bd_openers;
+    mutex_unlock(&bdev->bd_mutex);
+    bdput(bdev);
+    return open;
+}
+
+/*
+ * A composite device has no data of its own, its I/O is copied straight
+ * to the pages of the members. Members must not be open, are made
+ * read-only for everybody else and cannot be resized.
+ */
+static int sbdd_compose_setup(struct sbdd *dev, const struct sbdd_opts *opts)
+{
+    struct sbdd *member;
+    unsigned int i;
+
+    dev->layout = opts->layout;
+    dev->chunk_shift = opts->chunk_shift;
+    /* Members were checked by compose_com(), commands are serialized */
+    dev->capacity = sbdd_compose_capacity(opts);
+    if (!dev->capacity)
+        return -EINVAL;
+
+    dev->members = kmemdup(opts->members, opts->nr_members * sizeof(struct sbdd *), GFP_KERNEL);
+    if (!dev->members) {
+        pr_err("unable to alloc members\n");
+        return -ENOMEM;
+    }
+    /* Claimed members are released by sbdd_release() on failure */
+    for (i = 0; i < opts->nr_members; i++) {
+        member = dev->members[i];
+        WRITE_ONCE(member->holder, dev);
+        member->was_ro = get_disk_ro(member->gd);
+        set_disk_ro(member->gd, 1);
+        dev->nr_members++;
+        if (sbdd_is_open(member)) {
+            pr_err("device %s is in use\n", member->name);
+            return -EBUSY;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Splits the device into zones, the capacity is truncated to whole zones.
+ * The first conv_zones zones are conventional, the rest are sequential
+ * write required.
+ */
+static int sbdd_zones_setup(struct sbdd *dev, const struct sbdd_opts *opts)
+{
+    unsigned int i;
+
+    dev->zone_shift = ilog2((sector_t)opts->zone_size_mib * SBDD_MIB_SECTORS);
+    dev->nr_zones = dev->capacity >> dev->zone_shift;
+    if (!dev->nr_zones || opts->conv_zones >= dev->nr_zones) {
+        pr_err("device must have at least one sequential zone\n");
+        return -EINVAL;
+    }
+    dev->capacity = (sector_t)dev->nr_zones << dev->zone_shift;
+    dev->max_open = opts->max_open;
+    spin_lock_init(&dev->open_lock);
+    INIT_LIST_HEAD(&dev->open_zones);
+
+    pr_info("allocating %u zones\n", dev->nr_zones);
+    dev->zones = kvcalloc(dev->nr_zones, sizeof(struct sbdd_zone), GFP_KERNEL);
+    if (!dev->zones) {
+        pr_err("unable to alloc zones\n");
+        return -ENOMEM;
+    }
+    for (i = 0; i < dev->nr_zones; i++) {
+        spin_lock_init(&dev->zones[i].lock);
+        INIT_LIST_HEAD(&dev->zones[i].open_link);
+        if (i < opts->conv_zones) {
+            dev->zones[i].type = BLK_ZONE_TYPE_CONVENTIONAL;
+            dev->zones[i].cond = BLK_ZONE_COND_NOT_WP;
+            dev->zones[i].wp = sbdd_zone_start(dev, i + 1);
+        } else {
+            dev->zones[i].type = BLK_ZONE_TYPE_SEQWRITE_REQ;
+            dev->zones[i].cond = BLK_ZONE_COND_EMPTY;
+            dev->zones[i].wp = sbdd_zone_start(dev, i);
+        }
+    }
+    return 0;
+}
+
+/* Undoes a failed sbdd_setup() leaving the slot free again */
+static void sbdd_setup_undo(struct sbdd *dev)
+{
+    if (dev->q)
+        blk_cleanup_queue(dev->q);
+    if (dev->gd)
+        put_disk(dev->gd);
+#ifdef BLK_MQ_MODE
+    if (dev->tag_set && dev->tag_set->tags)
+        blk_mq_free_tag_set(dev->tag_set);
+    kfree(dev->tag_set);
+#endif
     kvfree(dev->name);
+    sbdd_release(dev);
 }
 
-static int sbdd_setup(struct sbdd *dev, size_t idx, unsigned long capacity_mib, char* name, size_t name_len)
+static int sbdd_setup(struct sbdd *dev, size_t idx, unsigned long capacity_mib, char* name, size_t name_len,
+                      const struct sbdd_opts *opts)
 {
     int ret = 0;
     memset(dev, 0, sizeof(struct sbdd));
     dev->capacity = (sector_t)capacity_mib * SBDD_MIB_SECTORS;
 
-    pr_info("allocating data\n");
-    dev->data = vmalloc(dev->capacity << SBDD_SECTOR_SHIFT);
-    if (!dev->data) {
-        pr_err("unable to alloc data\n");
+    /* Set first, a named slot is what find_device_by_name() looks at */
+    dev->name = kzalloc(name_len, GFP_KERNEL);
+    if(!dev->name){
+        pr_err("cannot allocate memory for device name\n");
         return -ENOMEM;
     }
+    scnprintf(dev->name, name_len, "%s", name);
+
+    /* Pages are allocated on the first write */
+    xa_init(&dev->pages);
+    xa_init(&dev->pi);
+    dev->pi_csum = opts->pi_csum;
+    dev->numa_node = opts->numa_node;
+    init_rwsem(&dev->evict_sem);
+    INIT_DELAYED_WORK(&dev->wb_work, sbdd_writeback_work);
+    INIT_WORK(&dev->fault_work, sbdd_fault_work);
+    spin_lock_init(&dev->fault_lock);
+#ifdef BLK_MQ_MODE
+    INIT_LIST_HEAD(&dev->fault_rqs);
+#else
+    bio_list_init(&dev->fault_bios);
+#endif
 
     spin_lock_init(&dev->datalock);
     spin_lock_init(&dev->transferring);
     init_waitqueue_head(&dev->exitwait);
 
+    if (opts->nr_members) {
+        ret = sbdd_compose_setup(dev, opts);
+        if (ret)
+            goto undo;
+    }
+
+    if (opts->zoned) {
+        ret = sbdd_zones_setup(dev, opts);
+        if (ret)
+            goto undo;
+    }
+
+    if (opts->backing_path) {
+        ret = sbdd_backing_setup(dev, opts);
+        if (ret)
+            goto undo;
+    }
+
 #ifdef BLK_MQ_MODE
     pr_info("allocating tag_set\n");
     dev->tag_set = kzalloc(sizeof(struct blk_mq_tag_set), GFP_KERNEL);
     if (!dev->tag_set) {
         pr_err("unable to alloc tag_set\n");
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto undo;
     }
 
     /* Number of hardware dispatch queues */
     dev->tag_set->nr_hw_queues = 1;
     /* Depth of hardware dispatch queues */
     dev->tag_set->queue_depth = 128;
-    dev->tag_set->numa_node = NUMA_NO_NODE;
+    dev->tag_set->numa_node = dev->numa_node;
     dev->tag_set->ops = &__sbdd_blk_mq_ops;
+    dev->tag_set->cmd_size = sizeof(struct sbdd_cmd);
+    /* Page allocation and backing file I/O may sleep in queue_rq */
+    dev->tag_set->flags = BLK_MQ_F_BLOCKING;
 
-    ret = blk_mq_alloc_tag_set(_dev->tag_set);
+    ret = blk_mq_alloc_tag_set(dev->tag_set);
     if (ret) {
         pr_err("call blk_mq_alloc_tag_set() failed with %d\n", ret);
-        return ret;
+        goto undo;
     }
 
     /* Creates both the hardware and the software queues and initializes structs */
@@ -539,24 +2407,39 @@ static int sbdd_setup(struct sbdd *dev, size_t idx, unsigned long capacity_mib,
         ret = (int)PTR_ERR(dev->q);
         pr_err("call blk_mq_init_queue() failed witn %d\n", ret);
         dev->q = NULL;
-        return ret;
+        goto undo;
     }
 #else
     pr_info("allocating queue\n");
     dev->q = blk_alloc_queue(GFP_KERNEL);
     if (!dev->q) {
         pr_err("call blk_alloc_queue() failed\n");
-        return -EINVAL;
+        ret = -EINVAL;
+        goto undo;
     }
     blk_queue_make_request(dev->q, sbdd_make_request);
 #endif /* BLK_MQ_MODE */
 
     /* Configure queue */
     blk_queue_logical_block_size(dev->q, SBDD_SECTOR_SIZE);
+    if (dev->zones) {
+        dev->q->limits.zoned = BLK_ZONED_HM;
+        blk_queue_chunk_sectors(dev->q, 1 << dev->zone_shift);
+        blk_queue_flag_set(QUEUE_FLAG_ZONE_RESETALL, dev->q);
+#ifdef BLK_MQ_MODE
+        /* Keeps the writes of a zone in order */
+        blk_queue_required_elevator_features(dev->q, ELEVATOR_F_ZBD_SEQ_WRITE);
+#endif
+    }
 
     /* A disk must have at least one minor */
     pr_info("allocating disk\n");
     dev->gd = alloc_disk(1);
+    if (!dev->gd) {
+        pr_err("call alloc_disk() failed\n");
+        ret = -ENOMEM;
+        goto undo;
+    }
 
     /* Configure gendisk */
     dev->gd->queue = dev->q;
@@ -568,6 +2451,26 @@ static int sbdd_setup(struct sbdd *dev, size_t idx, unsigned long capacity_mib,
     scnprintf(dev->gd->disk_name, name_len, "%s", name);
     set_capacity(dev->gd, dev->capacity);
 
+#ifdef CONFIG_BLK_DEV_INTEGRITY
+    if (dev->pi_csum) {
+        struct blk_integrity bi = {
+            .profile = dev->pi_csum == sbdd_crc_fn ? &t10_pi_type1_crc : &t10_pi_type1_ip,
+            .tuple_size = sizeof(struct t10_pi_tuple),
+            .interval_exp = SBDD_SECTOR_SHIFT,
+        };
+        pr_info("registering integrity profile %s\n", bi.profile->name);
+        blk_integrity_register(dev->gd, &bi);
+    }
+#endif
+
+    if (dev->zones) {
+        ret = blk_revalidate_disk_zones(dev->gd);
+        if (ret) {
+            pr_err("call blk_revalidate_disk_zones() failed with %d\n", ret);
+            goto undo;
+        }
+    }
+
     /*
     Allocating gd does not make it available, add_disk() required.
     After this call, gd methods can be called at any time. Should not be
@@ -575,15 +2478,10 @@ static int sbdd_setup(struct sbdd *dev, size_t idx, unsigned long capacity_mib,
     */
     pr_info("adding disk\n");
     add_disk(dev->gd);
-    if(!ret){
-        ret = sbdd_device_register(dev, name);
-    }
-    dev->name = kzalloc(name_len, GFP_KERNEL);
-    if(!name){
-        pr_err("cannot allocate memory for device name\n");
-        return -ENOMEM;
-    }
-    scnprintf(dev->name, name_len, "%s", name);
+    return sbdd_device_register(dev, name);
+
+    undo:
+    sbdd_setup_undo(dev);
     return ret;
 }
 
@@ -592,13 +2490,14 @@ static struct sbdd *find_device_by_name(char *name){
     for(i = 0; i < MAX_DEVICES; i++){
         if(!memcmp(&__devices[i], &__zero_sbdd, sizeof(struct sbdd)))
             break;
-        if(!strcmp(name, __devices[i].name))
+        if(__devices[i].name && !strcmp(name, __devices[i].name))
             return &__devices[i];
     }
     return NULL;
 }
 
-static int add_new_sbdd(unsigned long capacity_mib, char* name, size_t name_len)
+static int add_new_sbdd(unsigned long capacity_mib, char* name, size_t name_len,
+                        const struct sbdd_opts *opts)
 {
     int i = 0;
     spin_lock(&__creating_new_disk);
@@ -613,7 +2512,7 @@ static int add_new_sbdd(unsigned long capacity_mib, char* name, size_t name_len)
         int res = memcmp(&__devices[i], &__zero_sbdd, sizeof (struct sbdd));
         if(!res){
             spin_unlock(&__creating_new_disk);
-            return sbdd_setup(&__devices[i], i, capacity_mib, name, name_len);
+            return sbdd_setup(&__devices[i], i, capacity_mib, name, name_len, opts);
         }
     }
     pr_info("too many devices\n");
@@ -644,8 +2543,10 @@ static int sbdd_create(void)
         int i;
         for(i = 0; i < MAX_DEVICES; i++){
             char name[5] = {0};
+            struct sbdd_opts opts;
+            sbdd_opts_init(&opts);
             sprintf(name, "%s%x", SBDEV_NAME, i);
-            add_new_sbdd(__sbdd_capacity_mib, name, 5);
+            add_new_sbdd(__sbdd_capacity_mib, name, 5, &opts);
         }
     }
 	return ret;
@@ -682,19 +2583,16 @@ static void sbdd_destroy(struct sbdd *dev){
         kfree(dev->tag_set);
 #endif
 
-    if (dev->data) {
-        pr_info("freeing data\n");
-        vfree(dev->data);
-    }
-    memset(dev, 0, sizeof(struct sbdd));
+    sbdd_release(dev);
 }
 
 static void sbdd_delete(void)
 {
-    u8 i;
-    for(i = 0; i < MAX_DEVICES; i++){
+    int i;
+    /* Composite devices are created after their members, so go backwards */
+    for(i = MAX_DEVICES - 1; i >= 0; i--){
         if(!memcmp(&__devices[i], &__zero_sbdd, sizeof(struct sbdd)))
-            break;
+            continue;
         sbdd_destroy(&__devices[i]);
     }
 	if (__sbdd_major > 0) {
@@ -718,15 +2616,21 @@ static int __init sbdd_init(void)
     spin_lock_init(&__creating_new_disk);
 	pr_info("starting initialization...\n");
     check_mode();
+    check_cold_interval();
+    __sbdd_wq = alloc_workqueue("sbdd", WQ_MEM_RECLAIM | WQ_UNBOUND, 0);
+    if(!__sbdd_wq){
+        pr_warn("initialization failed\n");
+        return -ENOMEM;
+    }
     ret = sbdd_bus_register();
     if(ret){
         pr_warn("initialization failed\n");
-        goto unregister_bus;
+        goto destroy_wq;
     }
     ret = register_sbd_driver(&sbddrv);
     if(ret){
         pr_warn("initialization failed\n");
-        goto unregister_driver;
+        goto unregister_bus;
     }
 	ret = sbdd_create();
 
@@ -740,6 +2644,7 @@ static int __init sbdd_init(void)
     sbdd_delete: sbdd_delete();
     unregister_driver: unregister_sbd_driver(&sbddrv);
     unregister_bus: sbdd_bus_unregister();
+    destroy_wq: destroy_workqueue(__sbdd_wq);
 	return ret;
 }
 
@@ -754,6 +2659,7 @@ static void __exit sbdd_exit(void)
 	sbdd_delete();
     unregister_sbd_driver(&sbddrv);
     sbdd_bus_unregister();
+    destroy_workqueue(__sbdd_wq);
 	pr_info("exiting complete\n");
 }
 
@@ -766,6 +2672,9 @@ module_exit(sbdd_exit);
 /* Set desired capacity with insmod */
 module_param_named(capacity_mib, __sbdd_capacity_mib, ulong, S_IRUGO);
 
+/* Set default time in ms after which untouched pages are written back */
+module_param_named(cold_interval_ms, __sbdd_cold_interval_ms, uint, S_IRUGO);
+
 /* Set driver mode: 0 - disks are created automatically, 1 - disks are created by user */
 module_param_named(mode, __pre_mode, uint, S_IRUGO);
 